@@ -0,0 +1,95 @@
+/*
+ * bootloader_protocol.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: Doug
+ *
+ * Copyright (C) 2011-2026 Doug Brown
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BOOTLOADER_PROTOCOL_H_
+#define BOOTLOADER_PROTOCOL_H_
+
+/// Commands that are only understood by the bootloader. They are numbered
+/// well above the main firmware's ProgrammerCommand values (see
+/// SIMMProgrammer/programmer_protocol.h) so they can never collide.
+typedef enum BootloaderCommand
+{
+	GetBootTimestamps = 0x80,   //!< Reply with the boot phase timestamps
+	EnterProgrammerKeepUSB,     //!< Like EnterProgrammer, but hand off USB without re-enumerating (CommandReplyInvalid if not possible)
+	GetWriteSessionStats,       //!< Reply with the size and duration of the last firmware write
+	GetNonvolatileDataSize,     //!< Reply with the size of the EEPROM/data flash
+	ReadNonvolatileData,        //!< Read a block of EEPROM/data flash
+	WriteNonvolatileData        //!< Write a block of EEPROM/data flash
+} BootloaderCommand;
+
+/// Extra bytes the host can send while waiting to send the next chunk of a
+/// BootloaderEraseAndWriteProgram session, alongside ComputerBootloaderWriteMore etc.
+typedef enum BootloaderWriteCommand
+{
+	/// Followed by BOOTLOADER_CHUNK_SYNC_1, BOOTLOADER_CHUNK_SYNC_2, a 16-bit
+	/// chunk index, PROGRAM_CHUNK_SIZE_BYTES of data, and the CRC-32 of the
+	/// index and data together (all little-endian). The bootloader replies
+	/// with BootloaderWriteOK and the 16-bit index once the chunk is written,
+	/// BootloaderWriteRetry if a chunk has to be sent again, or
+	/// BootloaderWriteError if the index is past the end of the firmware
+	/// area. Either way, the session carries on. The host should resend any
+	/// chunk whose index hasn't come back with BootloaderWriteOK. Once this
+	/// has been used, ComputerBootloaderWriteMore is refused for the rest of
+	/// the session. Only built with BOOTLOADER_CHECKED_CHUNKS.
+	ComputerBootloaderWriteChunk = 0x10
+} BootloaderWriteCommand;
+
+/// Sync bytes that must follow ComputerBootloaderWriteChunk, so a stray 0x10
+/// in leftover chunk data isn't mistaken for the start of a chunk
+#define BOOTLOADER_CHUNK_SYNC_1		0xA5
+#define BOOTLOADER_CHUNK_SYNC_2		0x5A
+
+/// Extra replies the bootloader can send during a write session
+typedef enum BootloaderWriteReply
+{
+	/// Followed by the 16-bit little-endian index of the chunk the host
+	/// should send (again) with ComputerBootloaderWriteChunk. If the bootloader
+	/// lost sync, it only sends this after the host has stopped sending for
+	/// 100 ms, so everything after it can be trusted. It's never sent in a
+	/// session that hasn't used ComputerBootloaderWriteChunk.
+	BootloaderWriteRetry = 0x10
+} BootloaderWriteReply;
+
+/// The nonvolatile data commands are only built with BOOTLOADER_NV_DATA.
+/// ReadNonvolatileData and WriteNonvolatileData are acknowledged with
+/// CommandReplyOK right away. The host then sends a 32-bit offset and a
+/// 16-bit length (both little-endian). The length can be up to
+/// NONVOLATILE_DATA_MAX_BLOCK bytes. The bootloader replies CommandReplyOK if
+/// the block is in range, or CommandReplyError if not. For a read, the data
+/// follows the reply. For a write, the host then sends the data, and the
+/// bootloader replies CommandReplyOK or CommandReplyError once it's written.
+#define NONVOLATILE_DATA_MAX_BLOCK	512
+
+/// Boot phases that are timestamped in microseconds since reset.
+/// GetBootTimestamps replies with CommandReplyOK, the number of phases,
+/// then one 32-bit little-endian timestamp per phase in this order.
+typedef enum BootPhase
+{
+	BootPhaseClocksStable = 0,  //!< InitHardware finished setting up the clocks
+	BootPhaseUSBAttached,       //!< USB has been initialized and is attached to the bus
+	BootPhaseUSBConfigured,     //!< The host has configured the USB device
+	BootPhaseFirstCommand,      //!< The first byte from the host was received
+	NumBootPhases
+} BootPhase;
+
+#endif /* BOOTLOADER_PROTOCOL_H_ */
@@ -0,0 +1,67 @@
+/*
+ * crc32.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: Doug
+ *
+ * Copyright (C) 2011-2026 Doug Brown
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "crc32.h"
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+
+/// CRC-32 of each possible nibble, so we can go 4 bits at a time
+static const uint32_t crc32NibbleTable[16] PROGMEM = {
+	0x00000000UL, 0x1DB71064UL, 0x3B6E20C8UL, 0x26D930ACUL,
+	0x76DC4190UL, 0x6B6B51F4UL, 0x4DB26158UL, 0x5005713CUL,
+	0xEDB88320UL, 0xF00F9344UL, 0xD6D6A3E8UL, 0xCB61B38CUL,
+	0x9B64C2B0UL, 0x86D3D2D4UL, 0xA00AE278UL, 0xBDBDF21CUL
+};
+#endif
+
+/** Adds data to a CRC-32 calculation
+ *
+ * This is the standard reflected CRC-32 (polynomial 0xEDB88320) used by zlib,
+ * Ethernet, etc. The AVR has no barrel shifter, so it uses a 64-byte nibble
+ * table, which is about twice as fast as going a bit at a time. The M258 is
+ * fast enough a bit at a time, and LDROM space is tighter there.
+ *
+ * @param crc The CRC so far (CRC32_INITIAL to start a new one)
+ * @param data The data to add
+ * @param length The number of bytes of data
+ * @return The updated CRC
+ */
+uint32_t CRC32_Update(uint32_t crc, uint8_t const *data, uint32_t length)
+{
+	while (length--)
+	{
+		crc ^= *data++;
+#ifdef __AVR__
+		crc = (crc >> 4) ^ pgm_read_dword(&crc32NibbleTable[crc & 0x0F]);
+		crc = (crc >> 4) ^ pgm_read_dword(&crc32NibbleTable[crc & 0x0F]);
+#else
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ (0xEDB88320UL & -(crc & 1));
+		}
+#endif
+	}
+
+	return crc;
+}
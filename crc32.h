@@ -0,0 +1,44 @@
+/*
+ * crc32.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: Doug
+ *
+ * Copyright (C) 2011-2026 Doug Brown
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CRC32_H_
+#define CRC32_H_
+
+#include <stdint.h>
+
+/// Initial value to pass to CRC32_Update for a new CRC
+#define CRC32_INITIAL		0xFFFFFFFFUL
+
+uint32_t CRC32_Update(uint32_t crc, uint8_t const *data, uint32_t length);
+
+/** Finishes a CRC calculation
+ *
+ * @param crc The value returned by the last call to CRC32_Update
+ * @return The final CRC-32
+ */
+static inline uint32_t CRC32_Final(uint32_t crc)
+{
+	return ~crc;
+}
+
+#endif /* CRC32_H_ */
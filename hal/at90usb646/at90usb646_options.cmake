@@ -10,6 +10,15 @@ target_compile_definitions(SIMMProgrammerBootloader.elf PRIVATE
 	USE_LUFA_CONFIG_HEADER
 )
 
+# Double-banked CDC data endpoints. This can be turned off to compare upload
+# throughput with GetWriteSessionStats.
+option(AT90USB646_CDC_DOUBLE_BANK "Double-bank the CDC data endpoints" ON)
+if(AT90USB646_CDC_DOUBLE_BANK)
+	target_compile_definitions(SIMMProgrammerBootloader.elf PRIVATE
+		AT90USB646_CDC_DOUBLE_BANK
+	)
+endif()
+
 # AVR-specific compiler options
 # "No jump tables option" is needed in order to work around bug in older AVR GCC
 # where the bootloader relocation causes problems with jump tables
@@ -22,12 +22,62 @@
  */
 
 #include "hardware.h"
+#include <avr/interrupt.h>
+
+#include "../../SIMMProgrammer/hal/at90usb646/Descriptors.h"
+
+// Bulk endpoints on a full-speed device can't be any bigger than 64 bytes,
+// and anything smaller costs us throughput while streaming firmware.
+_Static_assert(CDC_TXRX_EPSIZE == 64, "CDC data endpoints should be 64 bytes for fast firmware uploads");
+
+/// Number of whole seconds counted by the boot timer
+static volatile uint16_t bootTimerSeconds = 0;
+
+/** Boot timer compare interrupt, fires once per second */
+ISR(TIMER1_COMPA_vect)
+{
+	bootTimerSeconds++;
+}
+
+/** Gets the current boot timer value
+ *
+ * @return The number of microseconds since the bootloader started
+ */
+uint32_t BootTimer_Micros(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+
+	uint16_t seconds = bootTimerSeconds;
+	uint16_t ticks = TCNT1;
+
+	// If the timer wrapped while interrupts were disabled, the interrupt
+	// hasn't counted it yet, so account for it here.
+	if ((TIFR1 & (1 << OCF1A)) && ticks < BOOT_TIMER_TICKS_PER_SEC / 2)
+	{
+		seconds++;
+	}
+
+	SREG = sreg;
+
+	return (uint32_t)seconds * 1000000UL + (uint32_t)ticks * (1000000UL / BOOT_TIMER_TICKS_PER_SEC);
+}
 
 /** Event handler for the library USB Configuration Changed event. */
 void EVENT_USB_Device_ConfigurationChanged(void)
 {
 	bool ConfigSuccess = true;
 
+#ifdef AT90USB646_CDC_DOUBLE_BANK
+	// The shared CDC definition uses single-banked data endpoints. The host
+	// waits for BootloaderWriteOK after every 1 KB chunk, so nothing is
+	// queued up while we're in WriteFlash either way. A second bank only
+	// lets the next packet of a chunk arrive while we're still reading the
+	// previous one, instead of it being NAKed until we release the bank.
+	VirtualSerial_CDC_Interface.Config.DataINEndpointDoubleBank = true;
+	VirtualSerial_CDC_Interface.Config.DataOUTEndpointDoubleBank = true;
+#endif
+
 	ConfigSuccess &= CDC_Device_ConfigureEndpoints(&VirtualSerial_CDC_Interface);
 }
 
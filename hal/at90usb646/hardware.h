@@ -27,8 +27,10 @@
 #include <avr/io.h>
 #include <util/delay.h>
 #include <avr/boot.h>
+#include <avr/eeprom.h>
 #include "../../SIMMProgrammer/hal/at90usb646/LUFA/Drivers/USB/USB.h"
 #include "../../SIMMProgrammer/hal/at90usb646/cdc_device_definition.h"
+#include "../../usb_handoff.h"
 
 /// Bitmask of the LED in its port/pin/DDR registers
 #define LED_PORT_MASK			(1 << 7)
@@ -41,6 +43,14 @@
 #define FIRMWARE_1KB_CHUNKS		56 // 56 x 1024 byte chunks = 56K
 #endif
 
+/// NVData_Write doesn't need any scratch space for EEPROM
+#define NVDATA_SCRATCH_SIZE		0
+
+/// Boot timer ticks per second (16 MHz / 256 prescaler = 16 us per tick)
+#define BOOT_TIMER_TICKS_PER_SEC	62500UL
+
+uint32_t BootTimer_Micros(void);
+
 /** Disables interrupts
  *
  */
@@ -57,11 +67,42 @@ static inline void EnableInterrupts(void)
 	sei();
 }
 
+/** Starts the boot timer, which counts time since the bootloader started
+ *
+ * Timer1 runs in CTC mode and wraps once per second. The compare interrupt
+ * keeps track of the number of whole seconds.
+ */
+static inline void BootTimer_Start(void)
+{
+	TCNT1 = 0;
+	OCR1A = BOOT_TIMER_TICKS_PER_SEC - 1;
+	TIMSK1 = (1 << OCIE1A);
+	TCCR1A = 0;
+	TCCR1B = (1 << WGM12) | (1 << CS12);
+}
+
+/** Stops the boot timer and puts Timer1 back into its reset state
+ *
+ * This must be done before jumping to the main firmware, because it won't
+ * have a handler for the timer interrupt.
+ */
+static inline void BootTimer_Stop(void)
+{
+	TCCR1B = 0;
+	TIMSK1 = 0;
+	TIFR1 = (1 << OCF1A);
+	TCNT1 = 0;
+	OCR1A = 0;
+}
+
 /** Does any initial hardware setup necessary on this processor
  *
  */
 static inline void InitHardware(void)
 {
+	// Start keeping track of time for boot phase timestamps
+	BootTimer_Start();
+
 	// Move interrupt vector table to bootloader section...
 	// (By default it's in the application section, and I need
 	// the interrupts to use USB correctly)
@@ -111,6 +152,15 @@ static inline void USBCDC_Init(void)
 	USB_Init();
 }
 
+/** Determines whether the host has configured the USB device yet
+ *
+ * @return True if the device is configured
+ */
+static inline bool USBCDC_IsConfigured(void)
+{
+	return USB_DeviceState == DEVICE_STATE_Configured;
+}
+
 /** Performs any necessary periodic tasks for the USB CDC serial port
  *
  */
@@ -192,6 +242,53 @@ static inline bool WriteFlash(uint8_t const *buffer, uint32_t locationInFlash)
 	return true;
 }
 
+/** Gets the number of 1 KB chunks that can be written with WriteFlash
+ *
+ * @return The number of chunks
+ */
+static inline uint16_t FirmwareChunkCount(void)
+{
+	return FIRMWARE_1KB_CHUNKS;
+}
+
+/** Gets the size of the nonvolatile data area (the AVR's EEPROM)
+ *
+ * @return The size in bytes
+ */
+static inline uint32_t NVData_Size(void)
+{
+	return E2END + 1;
+}
+
+/** Reads from the EEPROM
+ *
+ * @param buffer The buffer to read into
+ * @param offset The offset from the start of EEPROM
+ * @param length The number of bytes to read
+ */
+static inline void NVData_Read(uint8_t *buffer, uint32_t offset, uint16_t length)
+{
+	eeprom_read_block(buffer, (void const *)(uint16_t)offset, length);
+}
+
+/** Writes to the EEPROM
+ *
+ * Bytes that already contain the right value are skipped, which saves a lot
+ * of time (and EEPROM wear) when reprovisioning a board.
+ *
+ * @param buffer The data to write
+ * @param offset The offset from the start of EEPROM
+ * @param length The number of bytes to write
+ * @param scratch Unused; EEPROM doesn't need any scratch space
+ * @return True on success, false on failure
+ */
+static inline bool NVData_Write(uint8_t const *buffer, uint32_t offset, uint16_t length, uint8_t *scratch)
+{
+	(void)scratch;
+	eeprom_update_block(buffer, (void *)(uint16_t)offset, length);
+	return true;
+}
+
 /** Jumps to the main firmware
  *
  */
@@ -206,6 +303,9 @@ static inline void EnterMainFirmware(void)
 	// Disable interrupts...
 	DisableInterrupts();
 
+	// The main firmware doesn't expect Timer1 to be running
+	BootTimer_Stop();
+
 	// Change back to the application interrupt vector table
 	uint8_t tmpMCUCR = MCUCR;
 	MCUCR = tmpMCUCR | (1 << IVCE);
@@ -218,4 +318,35 @@ static inline void EnterMainFirmware(void)
 	__asm__ __volatile__ ( "jmp 0x0000" );
 }
 
+/** Determines whether EnterMainFirmwareKeepingUSB can be used
+ *
+ * @return Always true; the AVR can always jump straight to the main firmware
+ */
+static inline bool CanEnterMainFirmwareKeepingUSB(void)
+{
+	return true;
+}
+
+/** Jumps to the main firmware, leaving USB attached and configured
+ *
+ * The USB controller isn't reset by the jump, so the address, configured
+ * endpoints and their data toggles all stay intact in hardware. See
+ * usb_handoff.h for what the main firmware gets.
+ */
+static inline void EnterMainFirmwareKeepingUSB(void)
+{
+	DisableInterrupts();
+	BootTimer_Stop();
+
+	GPIOR1 = USB_Device_ConfigurationNumber;
+	GPIOR2 = USB_HANDOFF_MAGIC_AVR;
+
+	// Change back to the application interrupt vector table
+	uint8_t tmpMCUCR = MCUCR;
+	MCUCR = tmpMCUCR | (1 << IVCE);
+	MCUCR = tmpMCUCR & ~(1 << IVSEL);
+
+	__asm__ __volatile__ ( "jmp 0x0000" );
+}
+
 #endif /* HAL_AT90USB646_HARDWARE_H_ */
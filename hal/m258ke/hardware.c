@@ -22,17 +22,284 @@
  */
 
 #include "hardware.h"
+#include "../../crc32.h"
+#include <stddef.h>
 
-/** Goes to the main firmware immediately
+uint32_t resetCLKSEL1;
+uint32_t resetAHBCLK;
+
+/// Number of whole seconds counted by the boot timer
+static volatile uint32_t bootTimerSeconds = 0;
+
+/** Boot timer interrupt, fires once per second
  *
- * Sets up the watchdog timer for our protection.
  */
-void ResetToMainFirmware(void)
+void TMR0_IRQHandler(void)
+{
+	TIMER0->INTSTS = TIMER_INTSTS_TIF_Msk;
+	bootTimerSeconds++;
+}
+
+/** Gets the current boot timer value
+ *
+ * @return The number of microseconds since the bootloader started
+ */
+uint32_t BootTimer_Micros(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uint32_t seconds = bootTimerSeconds;
+	uint32_t ticks = TIMER0->CNT;
+
+	// If the timer wrapped while interrupts were disabled, the interrupt
+	// hasn't counted it yet, so account for it here.
+	if ((TIMER0->INTSTS & TIMER_INTSTS_TIF_Msk) && ticks < 500000)
+	{
+		seconds++;
+	}
+
+	__set_PRIMASK(primask);
+
+	return seconds * 1000000UL + ticks;
+}
+
+/** Runs an ISP command and waits for it to finish
+ *
+ * ISP must already be enabled.
+ *
+ * @param command The FMC command
+ * @param address The address to operate on
+ * @param data The data, for commands that write
+ * @return True on success, false if the ISP controller flagged a failure
+ */
+bool RunISPCommand(uint32_t command, uint32_t address, uint32_t data)
 {
-	// Start watchdog here. If we flash an invalid firmware (or there is none),
-	// the watchdog timer will expire and we'll end up back here.
-	// If we flash a good firmware, it'll stop the WDT (or keep feeding it) and
-	// everything will be happy.
+	FMC->ISPCMD = command;
+	FMC->ISPADDR = address;
+	FMC->ISPDAT = data;
+	FMC->ISPTRG = FMC_ISPTRG_ISPGO_Msk;
+	__ISB();
+	while (FMC->ISPTRG & FMC_ISPTRG_ISPGO_Msk);
+
+	if (FMC->ISPCTL & FMC_ISPCTL_ISPFF_Msk)
+	{
+		FMC->ISPCTL |= FMC_ISPCTL_ISPFF_Msk;
+		return false;
+	}
+
+	return true;
+}
+
+/** Finds where the data flash starts
+ *
+ * Data flash is enabled by clearing DFEN in CONFIG0, and it runs from DFBA
+ * to the end of APROM. Since the firmware area normally takes up all of
+ * APROM, data flash comes out of the top of it (see FirmwareChunkCount).
+ *
+ * @return The start address of data flash, or the end of APROM if there is none
+ */
+uint32_t NVData_Start(void)
+{
+	uint32_t dfba = FMC->DFBA;
+	if (!(ReadFlashWord(FMC_CONFIG0_ADDRESS) & 1) && dfba < APROM_SIZE_BYTES)
+	{
+		return dfba;
+	}
+	return APROM_SIZE_BYTES;
+}
+
+/** Reads from the data flash
+ *
+ * @param buffer The buffer to read into
+ * @param offset The offset from the start of data flash
+ * @param length The number of bytes to read
+ */
+void NVData_Read(uint8_t *buffer, uint32_t offset, uint16_t length)
+{
+	uint32_t address = NVData_Start() + offset;
+	while (length--)
+	{
+		buffer[0] = ReadFlashWord(address & ~3UL) >> (8 * (address & 3));
+		buffer++;
+		address++;
+	}
+}
+
+/** Writes to the data flash
+ *
+ * Each affected page is read, merged with the new data, and only erased and
+ * reprogrammed if something actually changed.
+ *
+ * @param buffer The data to write
+ * @param offset The offset from the start of data flash
+ * @param length The number of bytes to write
+ * @param scratch NVDATA_SCRATCH_SIZE bytes to merge each page in
+ * @return True on success, false on failure
+ */
+bool NVData_Write(uint8_t const *buffer, uint32_t offset, uint16_t length, uint8_t *scratch)
+{
+	uint8_t *page = scratch;
+	uint32_t address = NVData_Start() + offset;
+
+	while (length)
+	{
+		uint32_t pageStart = address & ~(FMC_PAGE_SIZE - 1UL);
+		uint32_t pageOffset = address - pageStart;
+		uint16_t count = FMC_PAGE_SIZE - pageOffset;
+		if (count > length)
+		{
+			count = length;
+		}
+
+		// Merge the new data into the page, noticing whether it changes
+		NVData_Read(page, pageStart - NVData_Start(), FMC_PAGE_SIZE);
+		bool changed = false;
+		for (uint16_t i = 0; i < count; i++)
+		{
+			changed |= page[pageOffset + i] != buffer[i];
+			page[pageOffset + i] = buffer[i];
+		}
+
+		if (changed)
+		{
+			DisableInterrupts();
+			FMC->ISPCTL |= FMC_ISPCTL_ISPEN_Msk | FMC_ISPCTL_APUEN_Msk;
+			bool ok = RunISPCommand(FMC_CMD_PAGE_ERASE, pageStart, 0);
+			for (uint32_t x = 0; ok && x < FMC_PAGE_SIZE; x += 4)
+			{
+				uint32_t data = ((uint32_t)page[x + 0] << 0) |
+								((uint32_t)page[x + 1] << 8) |
+								((uint32_t)page[x + 2] << 16) |
+								((uint32_t)page[x + 3] << 24);
+				ok = RunISPCommand(FMC_CMD_32BIT_PROGRAM, pageStart + x, data);
+			}
+			FMC->ISPCTL &= ~(FMC_ISPCTL_ISPEN_Msk | FMC_ISPCTL_APUEN_Msk);
+			EnableInterrupts();
+
+			if (!ok)
+			{
+				return false;
+			}
+		}
+
+		address += count;
+		buffer += count;
+		length -= count;
+	}
+
+	return true;
+}
+
+#ifdef M258KE_STAGED_UPDATES
+/** Calculates the CRC-32 of a region of flash
+ *
+ * @param address The start address (must be 4-byte aligned)
+ * @param size The number of bytes
+ * @return The CRC-32
+ */
+static uint32_t CRC32_Flash(uint32_t address, uint32_t size)
+{
+	uint32_t crc = CRC32_INITIAL;
+	for (uint32_t x = 0; x < size; x += 4)
+	{
+		uint32_t word = ReadFlashWord(address + x);
+		uint8_t bytes[4] = {word, word >> 8, word >> 16, word >> 24};
+		crc = CRC32_Update(crc, bytes, (size - x < 4) ? (size - x) : 4);
+	}
+	return CRC32_Final(crc);
+}
+
+/** Erases the staging header so the staged update won't be applied again
+ *
+ */
+static void EraseStagingHeader(void)
+{
+	FMC->ISPCTL |= FMC_ISPCTL_ISPEN_Msk | FMC_ISPCTL_APUEN_Msk;
+	RunISPCommand(FMC_CMD_PAGE_ERASE, STAGING_HEADER_ADDRESS, 0);
+	FMC->ISPCTL &= ~(FMC_ISPCTL_ISPEN_Msk | FMC_ISPCTL_APUEN_Msk);
+}
+
+/** Copies a staged firmware update into place
+ *
+ * The main firmware has already written the new image into the staging
+ * area and described it in the staging header. The image is checked,
+ * copied to the start of APROM a word at a time, and then checked again.
+ * The header is only erased once the copy has been verified, so if power
+ * is lost or the copy fails, it starts over on the next boot. Each try uses
+ * up one of the header's attempts, so flash that keeps failing doesn't
+ * keep us copying forever.
+ *
+ * @return True if the main firmware can be booted, false if it was damaged
+ */
+bool ApplyStagedUpdate(void)
+{
+	uint32_t size = ReadFlashWord(STAGING_HEADER_ADDRESS + offsetof(StagedUpdateHeader, size));
+	uint32_t crc = ReadFlashWord(STAGING_HEADER_ADDRESS + offsetof(StagedUpdateHeader, crc32));
+
+	// The image has to fit in the firmware area and in the staging area
+	// (which can't overlap the data flash), and it has to be intact.
+	// Otherwise, forget about it. We haven't touched the existing firmware.
+	if (size == 0 || size > FIRMWARE_1KB_CHUNKS * 1024UL ||
+		size > NVData_Start() - STAGED_IMAGE_ADDRESS ||
+		CRC32_Flash(STAGED_IMAGE_ADDRESS, size) != crc)
+	{
+		EraseStagingHeader();
+		return true;
+	}
+
+	// Find the next unused attempt. If they're all used up, the copy has
+	// failed too many times, so leave the firmware to be reflashed over USB.
+	uint32_t attempt = STAGING_HEADER_ADDRESS + offsetof(StagedUpdateHeader, attempts);
+	while (attempt < STAGING_HEADER_ADDRESS + sizeof(StagedUpdateHeader) &&
+		   ReadFlashWord(attempt) != 0xFFFFFFFFUL)
+	{
+		attempt += 4;
+	}
+	if (attempt >= STAGING_HEADER_ADDRESS + sizeof(StagedUpdateHeader))
+	{
+		EraseStagingHeader();
+		return false;
+	}
+
+	// Use it up, then copy the image over a page at a time. Each page is
+	// erased just before its first word is programmed, and anything past
+	// the end of the image is left erased.
+	FMC->ISPCTL |= FMC_ISPCTL_ISPEN_Msk | FMC_ISPCTL_APUEN_Msk;
+	bool ok = RunISPCommand(FMC_CMD_32BIT_PROGRAM, attempt, 0);
+	for (uint32_t x = 0; ok && x < size; x += 4)
+	{
+		if ((x & (FMC_PAGE_SIZE - 1)) == 0)
+		{
+			ok = RunISPCommand(FMC_CMD_PAGE_ERASE, x, 0);
+		}
+		ok = ok && RunISPCommand(FMC_CMD_32BIT_PROGRAM, x, ReadFlashWord(STAGED_IMAGE_ADDRESS + x));
+	}
+	FMC->ISPCTL &= ~FMC_ISPCTL_APUEN_Msk;
+
+	if (!ok || CRC32_Flash(0, size) != crc)
+	{
+		// Keep the header so we try again on the next boot
+		return false;
+	}
+
+	EraseStagingHeader();
+	return true;
+}
+#endif
+
+/** Arms the watchdog and sets up the chip to boot the main firmware
+ *
+ * If we flash an invalid firmware (or there is none), the watchdog timer
+ * will expire and we'll end up back in the bootloader. If we flash a good
+ * firmware, it'll stop the WDT (or keep feeding it) and everything will be
+ * happy.
+ */
+static void PrepareForMainFirmware(void)
+{
+	// The LIRC was enabled during startup, but we didn't wait for it.
+	// Make sure it's stable now before the watchdog depends on it.
+	while (!(CLK->STATUS & CLK_STATUS_LIRCSTB_Msk));
 
 	// Watchdog timer defaults to internal 38.4 kHz internal oscillator.
 	// Set timeout to 2^16 * WDT_CLK = 1.7 seconds
@@ -44,6 +311,18 @@ void ResetToMainFirmware(void)
 
 	// Boot to APROM next time
 	FMC->ISPCTL &= ~FMC_ISPCTL_BS_Msk;
+}
+
+/** Goes to the main firmware by resetting the chip
+ *
+ * Sets up the watchdog timer for our protection.
+ */
+void ResetToMainFirmware(void)
+{
+	PrepareForMainFirmware();
+
+	// The reset takes USB down with it, so there's nothing to hand off
+	BOOTLOADER_FLAG = 0;
 
 	// Reset!
 	NVIC_SystemReset();
@@ -51,3 +330,103 @@ void ResetToMainFirmware(void)
 	// Should never get here, but just in case...
 	while (1);
 }
+
+#ifdef M258KE_IAP
+/** Determines whether JumpToMainFirmware can skip the reset
+ *
+ * @return True if the chip is in IAP mode and the main firmware's initial
+ *         stack pointer and reset vector look valid
+ */
+bool CanJumpToMainFirmware(void)
+{
+	// Without IAP, APROM can't be remapped while we're running from LDROM
+	if (ReadFlashWord(FMC_CONFIG0_ADDRESS) & FMC_CONFIG0_CBS0_Msk)
+	{
+		return false;
+	}
+
+	uint32_t sp = ReadFlashWord(0);
+	uint32_t pc = ReadFlashWord(4);
+	return sp > SRAM_START && sp <= SRAM_START + SRAM_SIZE_BYTES && !(sp & 3) &&
+		(pc & 1) && pc < FIRMWARE_1KB_CHUNKS * 1024UL;
+}
+
+/** Goes to the main firmware immediately, without resetting the chip
+ *
+ * This puts everything the bootloader touched back into its reset state,
+ * maps APROM back to address 0, and jumps straight to the main firmware's
+ * reset handler. It saves a whole extra reset and clock setup on every boot.
+ * The watchdog is armed the same way as ResetToMainFirmware, so a bad image
+ * still ends up back in the bootloader.
+ *
+ * This is only built with M258KE_IAP, which links the bootloader to run from
+ * the LDROM's real address, and it only works if CONFIG0 selects IAP mode.
+ * Otherwise, or if the remap fails or the vector table doesn't look valid,
+ * we fall back to resetting.
+ *
+ * @param keepUSB True to leave the USB device controller running as-is
+ */
+void JumpToMainFirmware(bool keepUSB)
+{
+	DisableInterrupts();
+
+	if (!CanJumpToMainFirmware())
+	{
+		ResetToMainFirmware();
+	}
+
+	// Silence any interrupts we enabled
+	NVIC->ICER[0] = 0xFFFFFFFFUL;
+	NVIC->ICPR[0] = 0xFFFFFFFFUL;
+
+	// Reset the peripherals we used and turn their clocks back off
+	uint32_t resetMask = SYS_IPRST1_GPIORST_Msk | SYS_IPRST1_TMR0RST_Msk;
+	uint32_t clockMask = CLK_APBCLK0_TMR0CKEN_Msk;
+	if (!keepUSB)
+	{
+		resetMask |= SYS_IPRST1_USBDRST_Msk;
+		clockMask |= CLK_APBCLK0_USBDCKEN_Msk;
+	}
+	SYS->IPRST1 |= resetMask;
+	SYS->IPRST1 &= ~resetMask;
+	CLK->APBCLK0 &= ~clockMask;
+
+	// Make APROM's first page show up at address 0 again. If that fails,
+	// we have to reset after all, so let the host see USB go away first.
+	uint32_t sp = ReadFlashWord(0);
+	uint32_t pc = ReadFlashWord(4);
+	if (!RunISPCommand(FMC_CMD_VECTOR_REMAP, 0, 0))
+	{
+		if (keepUSB)
+		{
+			USBCDC_Disable();
+		}
+		ResetToMainFirmware();
+	}
+
+	PrepareForMainFirmware();
+
+	// Done with ISP. Put the clocks back the way they were out of reset,
+	// and lock protected registers again.
+	FMC->ISPCTL &= ~FMC_ISPCTL_ISPEN_Msk;
+	CLK->CLKSEL1 = resetCLKSEL1;
+	CLK->AHBCLK = resetAHBCLK;
+	SYS->REGLCTL = 0;
+
+	// Use the main firmware's vector table, then load its stack pointer
+	// and jump to its reset handler. Interrupts are enabled after a reset,
+	// and nothing is pending in the NVIC anymore, so turn them back on.
+	SCB->VTOR = 0;
+	__DSB();
+	__ISB();
+	__enable_irq();
+	__asm__ __volatile__ (
+		"msr msp, %0\n"
+		"bx %1\n"
+		: : "r" (sp), "r" (pc)
+	);
+
+	// Should never get here, but just in case...
+	while (1);
+}
+#endif
@@ -28,6 +28,7 @@
 #include <stdbool.h>
 #include "../../SIMMProgrammer/hal/m258ke/nuvoton/NuMicro.h"
 #include "../../SIMMProgrammer/hal/m258ke/usbcdc_hw.h"
+#include "../../usb_handoff.h"
 
 // Borrowed from Nuvoton's sample code
 #define GPIO_PIN_DATA(port, pin)	(*((volatile uint32_t *)((GPIO_PIN_DATA_BASE+(0x40*(port))) + ((pin)<<2))))
@@ -39,15 +40,112 @@
 #define LED_PIN						9
 #define LED_PORTPIN					PC9
 
+/// The M258KE3AE has 128 KB of APROM and 16 KB of SRAM
+#define APROM_SIZE_BYTES			(128UL * 1024UL)
+#define SRAM_START					0x20000000UL
+#define SRAM_SIZE_BYTES				(16UL * 1024UL)
+
+#ifdef M258KE_STAGED_UPDATES
+/// The number of 1 KB chunks we can use for the main firmware. With staged
+/// updates, the main firmware only gets the bottom half of the APROM, and the
+/// top half is the staging area. The main firmware has to agree on this split.
+#define FIRMWARE_1KB_CHUNKS			(APROM_SIZE_BYTES / 2 / 1024)
+#else
 /// The number of 1 KB chunks we can use for the main firmware.
-#define FIRMWARE_1KB_CHUNKS			128
-
+#define FIRMWARE_1KB_CHUNKS			(APROM_SIZE_BYTES / 1024)
+#endif
+
+/// Size of a flash page, the smallest unit that can be erased
+#define FMC_PAGE_SIZE				512
+/// NVData_Write needs a page of scratch space to merge data into
+#define NVDATA_SCRATCH_SIZE			FMC_PAGE_SIZE
+/// Where CONFIG0 can be read through the ISP controller
+#define FMC_CONFIG0_ADDRESS			0x00300000UL
+/// CBS[0] in CONFIG0. When it's clear, the chip boots in IAP mode, which lets
+/// LDROM code remap APROM back to address 0 and run it without a reset.
+#define FMC_CONFIG0_CBS0_Msk		(1UL << 6)
+/// FMC command for reading 32 bits from flash
+#define FMC_CMD_32BIT_READ			0x00
 /// FMC command for programming 32 bits to flash
 #define FMC_CMD_32BIT_PROGRAM		0x21
 /// FMC command for erasing a 512-byte page of flash
 #define FMC_CMD_PAGE_ERASE			0x22
-
+/// FMC command for remapping which flash page appears at address 0
+#define FMC_CMD_VECTOR_REMAP		0x2E
+
+#ifdef M258KE_STAGED_UPDATES
+/// The staging area is all of APROM above the firmware area (and below data
+/// flash, if enabled). Its first page holds a StagedUpdateHeader, and the
+/// staged image itself starts on the next page.
+#define STAGING_HEADER_ADDRESS		(FIRMWARE_1KB_CHUNKS * 1024UL)
+#define STAGED_IMAGE_ADDRESS		(STAGING_HEADER_ADDRESS + FMC_PAGE_SIZE)
+
+/// Magic value the main firmware puts at the start of the staging header
+#define STAGED_UPDATE_MAGIC			0x5AFEC0DEUL
+/// How many times we try to copy a staged update before giving up on it
+#define STAGED_UPDATE_MAX_ATTEMPTS	4
+
+/// Describes a firmware update that the main firmware has already written
+/// into the staging area. The main firmware programs this header last, after
+/// the image, and leaves the attempts erased. The bootloader programs one of
+/// the attempts to 0 before each copy, and only erases the header once the
+/// copy has been verified. An interrupted or failed copy starts over on the
+/// next boot until the attempts run out.
+typedef struct StagedUpdateHeader
+{
+	uint32_t magic;             //!< STAGED_UPDATE_MAGIC if an update is waiting
+	uint32_t size;              //!< Size of the new image in bytes
+	uint32_t crc32;             //!< Standard CRC-32 of the new image
+	uint32_t attempts[STAGED_UPDATE_MAX_ATTEMPTS]; //!< 0xFFFFFFFF until used up
+} StagedUpdateHeader;
+#endif
+
+/// The word in RAM the main firmware sets to STAY_IN_BOOTLOADER_MAGIC to ask
+/// us to stay in the bootloader. It's above the stack in both images. We
+/// also use it for the USB handoff (see usb_handoff.h).
+#define BOOTLOADER_FLAG				(*(uint32_t volatile *)0x20003FFC)
+#define STAY_IN_BOOTLOADER_MAGIC	0xBADF00D5UL
+
+/// CLKSEL1 and AHBCLK as they were out of reset, so that they can be put
+/// back before jumping to the main firmware
+extern uint32_t resetCLKSEL1;
+extern uint32_t resetAHBCLK;
+
+/// Nuvoton's USB driver keeps track of the current configuration here
+extern uint8_t volatile g_usbd_UsbConfig;
+
+bool RunISPCommand(uint32_t command, uint32_t address, uint32_t data);
 void ResetToMainFirmware(void);
+#ifdef M258KE_IAP
+bool CanJumpToMainFirmware(void);
+void JumpToMainFirmware(bool keepUSB);
+#else
+/** Determines whether JumpToMainFirmware can skip the reset
+ *
+ * @return False; without IAP, the only way is a reset
+ */
+static inline bool CanJumpToMainFirmware(void)
+{
+	return false;
+}
+
+/** Goes to the main firmware. Without IAP, the only way is a reset.
+ *
+ * @param keepUSB Ignored; USB can't survive the reset
+ */
+static inline void JumpToMainFirmware(bool keepUSB)
+{
+	(void)keepUSB;
+	ResetToMainFirmware();
+}
+#endif
+#ifdef M258KE_STAGED_UPDATES
+bool ApplyStagedUpdate(void);
+#endif
+uint32_t BootTimer_Micros(void);
+uint32_t NVData_Start(void);
+void NVData_Read(uint8_t *buffer, uint32_t offset, uint16_t length);
+bool NVData_Write(uint8_t const *buffer, uint32_t offset, uint16_t length, uint8_t *scratch);
 
 /** Disables interrupts
  *
@@ -65,6 +163,58 @@ static inline void EnableInterrupts(void)
 	__enable_irq();
 }
 
+/** Gets the number of 1 KB chunks that can be written with WriteFlash
+ *
+ * If data flash is enabled and starts inside the firmware area, the firmware
+ * area stops there, so that firmware writes can't overwrite it.
+ *
+ * @return The number of chunks
+ */
+static inline uint16_t FirmwareChunkCount(void)
+{
+	uint32_t dataFlashChunks = NVData_Start() / 1024;
+	return (dataFlashChunks < FIRMWARE_1KB_CHUNKS) ? dataFlashChunks : FIRMWARE_1KB_CHUNKS;
+}
+
+/** Gets the size of the nonvolatile data area (the M258's data flash)
+ *
+ * @return The size in bytes, or 0 if data flash isn't enabled
+ */
+static inline uint32_t NVData_Size(void)
+{
+	return APROM_SIZE_BYTES - NVData_Start();
+}
+
+/** Reads 32 bits from flash using the ISP controller
+ *
+ * @param address The address to read (must be 4-byte aligned)
+ * @return The data at that address
+ */
+static inline uint32_t ReadFlashWord(uint32_t address)
+{
+	FMC->ISPCTL |= FMC_ISPCTL_ISPEN_Msk;
+	RunISPCommand(FMC_CMD_32BIT_READ, address, 0);
+	return FMC->ISPDAT;
+}
+
+/** Starts the boot timer, which counts time since the bootloader started
+ *
+ * TIMER0 counts at 1 MHz from the HIRC, which is already running out of
+ * reset. It wraps and interrupts once per second so that the interrupt
+ * handler can keep track of the number of whole seconds.
+ */
+static inline void BootTimer_Start(void)
+{
+	CLK->CLKSEL1 = (CLK->CLKSEL1 & ~CLK_CLKSEL1_TMR0SEL_Msk) | (7 << CLK_CLKSEL1_TMR0SEL_Pos);
+	CLK->APBCLK0 |= CLK_APBCLK0_TMR0CKEN_Msk;
+
+	// 48 MHz / (47 + 1) = 1 MHz, periodic mode
+	TIMER0->CMP = 1000000;
+	TIMER0->CTL = TIMER_CTL_CNTEN_Msk | TIMER_CTL_INTEN_Msk |
+			(1 << TIMER_CTL_OPMODE_Pos) | (47 << TIMER_CTL_PSC_Pos);
+	NVIC_EnableIRQ(TMR0_IRQn);
+}
+
 /** Does any initial hardware setup necessary on this processor
  *
  */
@@ -78,12 +228,20 @@ static inline void InitHardware(void)
 		SYS->REGLCTL = 0x88UL;
 	} while (SYS->REGLCTL == 0UL);
 
+	// Remember the clock setup we're about to change
+	resetCLKSEL1 = CLK->CLKSEL1;
+	resetAHBCLK = CLK->AHBCLK;
+
+	// Start keeping track of time for boot phase timestamps
+	BootTimer_Start();
+
 	// Enable 48 MHz internal high-speed RC oscillator and 38.4 kHz low-speed RC oscillator
 	CLK->PWRCTL |= CLK_PWRCTL_HIRCEN_Msk | CLK_PWRCTL_LIRCEN_Msk;
 
-	// Wait until they're both ready
-	while ((CLK->STATUS & (CLK_STATUS_HIRCSTB_Msk | CLK_STATUS_LIRCSTB_Msk)) !=
-		   (CLK_STATUS_HIRCSTB_Msk | CLK_STATUS_LIRCSTB_Msk));
+	// Only wait for the HIRC. The LIRC is only needed by the watchdog, so
+	// we wait for it right before arming the watchdog instead. That way we
+	// don't hold up USB attach while it stabilizes.
+	while (!(CLK->STATUS & CLK_STATUS_HIRCSTB_Msk));
 
 	// Clock HCLK and USB from 48 MHz HIRC
 	CLK->CLKSEL0 = (CLK->CLKSEL0 & (~(CLK_CLKSEL0_HCLKSEL_Msk | CLK_CLKSEL0_USBDSEL_Msk))) |
@@ -103,13 +261,25 @@ static inline void InitHardware(void)
 	// Read flag from RAM to see if the main firmware asked us to stay in
 	// the bootloader (this would happen if we are doing a firmware update)
 	bool mainFirmwareAskedToStayInBootloader = false;
-	uint32_t *stayInBootloaderFlag = (uint32_t *)(0x20003FFC);
-	if (*stayInBootloaderFlag == 0xBADF00D5)
+	if (BOOTLOADER_FLAG == STAY_IN_BOOTLOADER_MAGIC)
 	{
 		mainFirmwareAskedToStayInBootloader = true;
-		*stayInBootloaderFlag = 0;
+		BOOTLOADER_FLAG = 0;
 	}
 
+	// If the main firmware left a staged firmware update for us, copy it
+	// into place now. If that fails, stay in the bootloader so that the
+	// firmware can still be reflashed over USB.
+	// (If data flash takes up the staging area, there's no staging area.)
+	bool stagedUpdateFailed = false;
+#ifdef M258KE_STAGED_UPDATES
+	if (NVData_Start() > STAGED_IMAGE_ADDRESS &&
+		ReadFlashWord(STAGING_HEADER_ADDRESS) == STAGED_UPDATE_MAGIC)
+	{
+		stagedUpdateFailed = !ApplyStagedUpdate();
+	}
+#endif
+
 	// Figure out if we're booting due to a watchdog timeout
 	// (this would happen if we tried to boot the main firmware but
 	// it crashed, e.g. if there is no firmware yet or it's corrupt)
@@ -126,9 +296,9 @@ static inline void InitHardware(void)
 
 	// If we didn't find any reason above to stay in the bootloader,
 	// go ahead and jump to the main firmware.
-	if (!watchdogged && !mainFirmwareAskedToStayInBootloader && !bootPinAskingForBootloader)
+	if (!watchdogged && !mainFirmwareAskedToStayInBootloader && !bootPinAskingForBootloader && !stagedUpdateFailed)
 	{
-		ResetToMainFirmware();
+		JumpToMainFirmware(false);
 	}
 }
 
@@ -168,6 +338,15 @@ static inline void LED_Toggle(void)
 	LED_PORTPIN = !LED_PORTPIN;
 }
 
+/** Determines whether the host has configured the USB device yet
+ *
+ * @return True if the device is configured
+ */
+static inline bool USBCDC_IsConfigured(void)
+{
+	return g_usbd_UsbConfig != 0;
+}
+
 /** Writes a chunk of data to flash
  *
  * @param buffer The buffer to write to flash (this will contain 1024 bytes to write)
@@ -183,50 +362,31 @@ static inline bool WriteFlash(uint8_t const *buffer, uint32_t locationInFlash)
 	FMC->ISPCTL |= FMC_ISPCTL_ISPEN_Msk | FMC_ISPCTL_APUEN_Msk;
 
 	// Each 1024-byte chunk represents two flash pages. Erase both of them...
-	for (uint32_t x = 0; x < 1024; x += 512)
+	// (bail out at the first failure)
+	bool ok = true;
+	for (uint32_t x = 0; ok && x < 1024; x += FMC_PAGE_SIZE)
 	{
-		FMC->ISPCMD = FMC_CMD_PAGE_ERASE;
-		FMC->ISPADDR = locationInFlash + x;
-		FMC->ISPTRG = FMC_ISPTRG_ISPGO_Msk;
-		__ISB();
-		while (FMC->ISPTRG & FMC_ISPTRG_ISPGO_Msk);
-
-		// Look for failures and bail
-		if (FMC->ISPCTL & FMC_ISPCTL_ISPFF_Msk)
-		{
-			FMC->ISPCTL |= FMC_ISPCTL_ISPFF_Msk;
-			return false;
-		}
+		ok = RunISPCommand(FMC_CMD_PAGE_ERASE, locationInFlash + x, 0);
 	}
 
 	// Now program all 1024 bytes, 4 at a time
-	for (uint32_t x = 0; x < 1024; x += 4)
+	for (uint32_t x = 0; ok && x < 1024; x += 4)
 	{
-		FMC->ISPCMD = FMC_CMD_32BIT_PROGRAM;
-		FMC->ISPADDR = locationInFlash + x;
-		FMC->ISPDAT = ((uint32_t)buffer[x + 0] << 0) |
-					  ((uint32_t)buffer[x + 1] << 8) |
-					  ((uint32_t)buffer[x + 2] << 16) |
-					  ((uint32_t)buffer[x + 3] << 24);
-		FMC->ISPTRG = FMC_ISPTRG_ISPGO_Msk;
-		__ISB();
-		while (FMC->ISPTRG & FMC_ISPTRG_ISPGO_Msk);
-
-		// Look for failures and bail
-		if (FMC->ISPCTL & FMC_ISPCTL_ISPFF_Msk)
-		{
-			FMC->ISPCTL |= FMC_ISPCTL_ISPFF_Msk;
-			return false;
-		}
+		uint32_t data = ((uint32_t)buffer[x + 0] << 0) |
+						((uint32_t)buffer[x + 1] << 8) |
+						((uint32_t)buffer[x + 2] << 16) |
+						((uint32_t)buffer[x + 3] << 24);
+		ok = RunISPCommand(FMC_CMD_32BIT_PROGRAM, locationInFlash + x, data);
 	}
 
-	// Disable ISP and updates to AP memory
+	// Disable ISP and updates to AP memory. Do this even on failure,
+	// since the chunk may be retried and USB still needs interrupts.
 	FMC->ISPCTL &= ~(FMC_ISPCTL_ISPEN_Msk | FMC_ISPCTL_APUEN_Msk);
 
 	// And now it's safe to re-enable interrupts
 	EnableInterrupts();
 
-	return true;
+	return ok;
 }
 
 /** Delays for about a second
@@ -261,8 +421,32 @@ static inline void EnterMainFirmware(void)
 	DelayAbout1Sec();
 	DelayAbout1Sec();
 
-	// Reset and go to the main firmware
-	ResetToMainFirmware();
+	// Go to the main firmware
+	JumpToMainFirmware(false);
+}
+
+/** Determines whether EnterMainFirmwareKeepingUSB can be used
+ *
+ * USB can only survive if we jump straight to the main firmware. Otherwise
+ * the reset would drop it without even disconnecting first.
+ *
+ * @return True if it can be used
+ */
+static inline bool CanEnterMainFirmwareKeepingUSB(void)
+{
+	return CanJumpToMainFirmware();
+}
+
+/** Jumps to the main firmware, leaving USB attached and configured
+ *
+ * The USB controller isn't reset, so the address and endpoint data toggles
+ * stay in its registers. See usb_handoff.h for what the main firmware gets.
+ */
+static inline void EnterMainFirmwareKeepingUSB(void)
+{
+	DisableInterrupts();
+	BOOTLOADER_FLAG = USB_HANDOFF_WORD(g_usbd_UsbConfig);
+	JumpToMainFirmware(true);
 }
 
 #endif /* HAL_M258KE_HARDWARE_H_ */
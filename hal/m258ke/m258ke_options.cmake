@@ -7,14 +7,35 @@ target_include_directories(SIMMProgrammerBootloader.elf PRIVATE
 target_compile_definitions(SIMMProgrammerBootloader.elf PRIVATE
 )
 
+# Staged updates split the APROM in half, so the main firmware has to be built
+# for the same split. They're off by default.
+option(M258KE_STAGED_UPDATES "Apply firmware updates staged in the top half of APROM at boot" OFF)
+if(M258KE_STAGED_UPDATES)
+	target_compile_definitions(SIMMProgrammerBootloader.elf PRIVATE
+		M258KE_STAGED_UPDATES
+	)
+endif()
+
 # M258KE-specific compiler options
 target_compile_options(SIMMProgrammerBootloader.elf PRIVATE
 	-mcpu=cortex-m23 -march=armv8-m.base -mthumb
 )
 
+# The IAP build runs from the LDROM's real address so it can jump straight to
+# the main firmware without a reset. It needs Config 0 set to LDROM with IAP.
+option(M258KE_IAP "Link for IAP mode and jump directly to the main firmware" OFF)
+if(M258KE_IAP)
+	set(M258KE_LINKER_SCRIPT ${CMAKE_SOURCE_DIR}/hal/m258ke/LDROM_IAP.ld)
+	target_compile_definitions(SIMMProgrammerBootloader.elf PRIVATE
+		M258KE_IAP
+	)
+else()
+	set(M258KE_LINKER_SCRIPT ${CMAKE_SOURCE_DIR}/SIMMProgrammer/hal/m258ke/nuvoton/LDROM.ld)
+endif()
+
 target_link_options(SIMMProgrammerBootloader.elf PRIVATE
 	-mcpu=cortex-m23 -march=armv8-m.base -mthumb
-	-T ${CMAKE_SOURCE_DIR}/SIMMProgrammer/hal/m258ke/nuvoton/LDROM.ld
+	-T ${M258KE_LINKER_SCRIPT}
 	--specs=nano.specs
 )
 
@@ -24,19 +24,52 @@
 // This include will come from whichever hardware is selected
 #include "hardware.h"
 #include "SIMMProgrammer/programmer_protocol.h"
+#include "bootloader_protocol.h"
+#include "crc32.h"
 
 /// Number of bytes sent at a time during firmware programming
 #define PROGRAM_CHUNK_SIZE_BYTES	1024
 
+#ifdef BOOTLOADER_CHECKED_CHUNKS
+/// Number of bytes after ComputerBootloaderWriteChunk: sync, 16-bit index, data, 32-bit CRC
+#define CHECKED_CHUNK_SIZE_BYTES	(2 + 2 + PROGRAM_CHUNK_SIZE_BYTES + 4)
+/// If a checked chunk stalls for this long, give up on it and ask for it again
+#define CHECKED_CHUNK_TIMEOUT_US	500000UL
+/// After losing sync, the line has to be quiet this long before we ask for a retry
+#define CHECKED_CHUNK_DRAIN_US		100000UL
+#endif
+
+// NV data blocks are received into the chunk buffer, and the HAL gets the
+// rest of it as scratch space for merging them into flash pages.
+#if NONVOLATILE_DATA_MAX_BLOCK + NVDATA_SCRATCH_SIZE > PROGRAM_CHUNK_SIZE_BYTES
+#error "NV data blocks and the NV data scratch space must fit in the firmware chunk buffer"
+#endif
+
 /// Current bootloader state
 typedef enum BootloaderCommandState
 {
 	WaitingForCommand = 0,//!< We're waiting to receive a command
-	WritingFirmware       //!< We're flashing the firmware
+	WritingFirmware,      //!< We're flashing the firmware
+#ifdef BOOTLOADER_NV_DATA
+	ReceivingNVRequest,   //!< We're receiving the offset/length of an NV data read/write
+	WritingNVData         //!< We're receiving data to write to NV data
+#endif
 } BootloaderCommandState;
 
 static void HandleEraseWriteByte(uint8_t byte);
+#ifdef BOOTLOADER_CHECKED_CHUNKS
+static void HandleCheckedChunkByte(uint8_t byte);
+static void CheckChunkTimeout(void);
+static void StartChunkDrain(uint16_t retryIndex);
+static void RequestChunkRetry(uint16_t index);
+#endif
 static void HandleWaitingForCommandByte(uint8_t byte);
+#ifdef BOOTLOADER_NV_DATA
+static void HandleNVRequestByte(uint8_t byte);
+static void HandleNVWriteByte(uint8_t byte);
+#endif
+static void RecordBootPhase(BootPhase phase);
+static void SendUInt32(uint32_t value);
 
 /// The current state
 static BootloaderCommandState curCommandState = WaitingForCommand;
@@ -44,6 +77,42 @@ static BootloaderCommandState curCommandState = WaitingForCommand;
 static int16_t writePosInChunk = -1;
 /// The current page index we are writing
 static uint16_t curWriteIndex = 0;
+#ifdef BOOTLOADER_CHECKED_CHUNKS
+/// True if the chunk being received was sent with ComputerBootloaderWriteChunk
+static bool checkedChunk = false;
+/// Index of the checked chunk being received
+static uint16_t checkedChunkIndex;
+/// CRC-32 the host sent for the checked chunk being received
+static uint32_t checkedChunkExpectedCRC;
+/// Boot timer value when the last byte of a checked chunk arrived
+static uint32_t lastChunkByteTime;
+/// True once a checked chunk with valid sync bytes has arrived in this session
+static bool sessionUsesCheckedChunks = false;
+/// True if we're throwing away input until the host stops sending
+static bool drainingChunk = false;
+/// Chunk to ask the host for once we're done draining
+static uint16_t drainRetryIndex;
+#endif
+/// Number of bytes actually written to flash in the current/last session
+static uint32_t writeSessionBytes = 0;
+/// Boot timer value when the current/last firmware write session started
+static uint32_t writeSessionStartTime = 0;
+/// Boot timer value when the last chunk of the current/last session was written
+static uint32_t writeSessionEndTime = 0;
+#ifdef BOOTLOADER_NV_DATA
+/// Which NV data command we're receiving the request for
+static BootloaderCommand nvCommand;
+/// Offset of the NV data block being read or written
+static uint32_t nvOffset;
+/// Length of the NV data block being read or written
+static uint16_t nvLength;
+/// Where we are in the NV data request or block
+static uint16_t nvPos;
+#endif
+/// Buffer for firmware chunks and NV data blocks
+static uint8_t chunkBuffer[PROGRAM_CHUNK_SIZE_BYTES];
+/// Time each boot phase was reached, in microseconds since reset (0 = not yet)
+static uint32_t bootPhaseTimes[NumBootPhases];
 
 /** Main program.
  *
@@ -54,22 +123,32 @@ int main(void)
 	DisableInterrupts();
 
 	InitHardware();
+	RecordBootPhase(BootPhaseClocksStable);
+
+	// Initialize USB and enable interrupts. This is done as early as
+	// possible so the host can start enumerating us right away.
+	USBCDC_Init();
+	EnableInterrupts();
+	RecordBootPhase(BootPhaseUSBAttached);
 
 	// Initialize the LED, default it to off
 	LED_Init();
 	LED_Off();
 
-	// Initialize USB and enable interrupts
-	USBCDC_Init();
-	EnableInterrupts();
-
 	// Run the USB task, listen for bytes, act in response.
 	while (1)
 	{
 		int16_t recvByte = USBCDC_ReadByte();
 
+		if (bootPhaseTimes[BootPhaseUSBConfigured] == 0 && USBCDC_IsConfigured())
+		{
+			RecordBootPhase(BootPhaseUSBConfigured);
+		}
+
 		if (recvByte >= 0)
 		{
+			RecordBootPhase(BootPhaseFirstCommand);
+
 			switch (curCommandState)
 			{
 			case WaitingForCommand:
@@ -78,9 +157,24 @@ int main(void)
 			case WritingFirmware:
 				HandleEraseWriteByte((uint8_t)recvByte);
 				break;
+#ifdef BOOTLOADER_NV_DATA
+			case ReceivingNVRequest:
+				HandleNVRequestByte((uint8_t)recvByte);
+				break;
+			case WritingNVData:
+				HandleNVWriteByte((uint8_t)recvByte);
+				break;
+#endif
 			}
 		}
 
+#ifdef BOOTLOADER_CHECKED_CHUNKS
+		if (curCommandState == WritingFirmware)
+		{
+			CheckChunkTimeout();
+		}
+#endif
+
 		USBCDC_Check();
 	}
 }
@@ -109,12 +203,64 @@ static void HandleWaitingForCommandByte(uint8_t byte)
 		// Now enter the main firmware
 		EnterMainFirmware();
 		break;
+	case EnterProgrammerKeepUSB:
+		// If USB can't survive the trip, let the host use EnterProgrammer
+		if (!CanEnterMainFirmwareKeepingUSB())
+		{
+			USBCDC_SendByte(CommandReplyInvalid);
+			curCommandState = WaitingForCommand;
+			break;
+		}
+		USBCDC_SendByte(CommandReplyOK);
+		USBCDC_Flush();
+		EnterMainFirmwareKeepingUSB();
+		break;
 	case BootloaderEraseAndWriteProgram:
 		curCommandState = WritingFirmware;
 		curWriteIndex = 0;
 		writePosInChunk = -1;
+#ifdef BOOTLOADER_CHECKED_CHUNKS
+		sessionUsesCheckedChunks = false;
+		drainingChunk = false;
+#endif
+		writeSessionBytes = 0;
+		writeSessionStartTime = BootTimer_Micros();
+		writeSessionEndTime = writeSessionStartTime;
+		USBCDC_SendByte(CommandReplyOK);
+		break;
+	case GetBootTimestamps:
+		USBCDC_SendByte(CommandReplyOK);
+		USBCDC_SendByte(NumBootPhases);
+		for (uint8_t i = 0; i < NumBootPhases; i++)
+		{
+			SendUInt32(bootPhaseTimes[i]);
+		}
+		curCommandState = WaitingForCommand;
+		break;
+	case GetWriteSessionStats:
+		// Bytes written and microseconds spent, so the host can work out
+		// the sustained throughput of the last firmware upload
+		USBCDC_SendByte(CommandReplyOK);
+		SendUInt32(writeSessionBytes);
+		SendUInt32(writeSessionEndTime - writeSessionStartTime);
+		curCommandState = WaitingForCommand;
+		break;
+#ifdef BOOTLOADER_NV_DATA
+	case GetNonvolatileDataSize:
 		USBCDC_SendByte(CommandReplyOK);
+		SendUInt32(NVData_Size());
+		curCommandState = WaitingForCommand;
+		break;
+	case ReadNonvolatileData:
+	case WriteNonvolatileData:
+		nvCommand = byte;
+		nvOffset = 0;
+		nvLength = 0;
+		nvPos = 0;
+		USBCDC_SendByte(CommandReplyOK);
+		curCommandState = ReceivingNVRequest;
 		break;
+#endif
 	default:
 		USBCDC_SendByte(CommandReplyInvalid);
 		curCommandState = WaitingForCommand;
@@ -128,15 +274,33 @@ static void HandleWaitingForCommandByte(uint8_t byte)
  */
 static void HandleEraseWriteByte(uint8_t byte)
 {
-	static uint8_t programChunkBytes[PROGRAM_CHUNK_SIZE_BYTES];
+#ifdef BOOTLOADER_CHECKED_CHUNKS
+	if (drainingChunk)
+	{
+		// Throw it away. CheckChunkTimeout asks for a retry once it's quiet.
+		lastChunkByteTime = BootTimer_Micros();
+		return;
+	}
+#endif
 
 	if (writePosInChunk == -1)
 	{
 		switch (byte)
 		{
 		case ComputerBootloaderWriteMore:
+#ifdef BOOTLOADER_CHECKED_CHUNKS
+			if (sessionUsesCheckedChunks)
+			{
+				// After a checked chunk, an unchecked one can't be trusted to
+				// be at the right place. It could just be data from a
+				// chunk we gave up on, so don't write it.
+				StartChunkDrain(curWriteIndex);
+				break;
+			}
+			checkedChunk = false;
+#endif
 			writePosInChunk = 0;
-			if (curWriteIndex < FIRMWARE_1KB_CHUNKS)
+			if (curWriteIndex < FirmwareChunkCount())
 			{
 				USBCDC_SendByte(BootloaderWriteOK);
 			}
@@ -157,22 +321,51 @@ static void HandleEraseWriteByte(uint8_t byte)
 			USBCDC_SendByte(BootloaderWriteConfirmCancel);
 			curCommandState = WaitingForCommand;
 			break;
+#ifdef BOOTLOADER_CHECKED_CHUNKS
+		case ComputerBootloaderWriteChunk:
+			// No reply until we have the whole chunk
+			writePosInChunk = 0;
+			checkedChunk = true;
+			checkedChunkIndex = 0;
+			checkedChunkExpectedCRC = 0;
+			lastChunkByteTime = BootTimer_Micros();
+			break;
+		default:
+			// Once the host is using checked chunks, we know it understands
+			// BootloaderWriteRetry. Wait until it stops sending before
+			// telling it which chunk we want next. Older hosts don't know
+			// about it, so for them, stray bytes are ignored like they
+			// always were.
+			if (sessionUsesCheckedChunks)
+			{
+				StartChunkDrain(curWriteIndex);
+			}
+			break;
+#endif
 		}
 	}
+#ifdef BOOTLOADER_CHECKED_CHUNKS
+	else if (checkedChunk)
+	{
+		HandleCheckedChunkByte(byte);
+	}
+#endif
 	else
 	{
-		programChunkBytes[writePosInChunk++] = byte;
+		chunkBuffer[writePosInChunk++] = byte;
 		if (writePosInChunk >= PROGRAM_CHUNK_SIZE_BYTES)
 		{
 			// Toggle the LED for some status
 			LED_Toggle();
 
 			// Write the actual flash now
-			if (WriteFlash(programChunkBytes, (uint32_t)curWriteIndex * (uint32_t)PROGRAM_CHUNK_SIZE_BYTES))
+			if (WriteFlash(chunkBuffer, (uint32_t)curWriteIndex * (uint32_t)PROGRAM_CHUNK_SIZE_BYTES))
 			{
 				USBCDC_SendByte(BootloaderWriteOK);
 				curWriteIndex++;
 				writePosInChunk = -1;
+				writeSessionBytes += PROGRAM_CHUNK_SIZE_BYTES;
+				writeSessionEndTime = BootTimer_Micros();
 			}
 			else
 			{
@@ -182,3 +375,253 @@ static void HandleEraseWriteByte(uint8_t byte)
 		}
 	}
 }
+
+#ifdef BOOTLOADER_CHECKED_CHUNKS
+/** Handler called when we receive a byte of a chunk sent with ComputerBootloaderWriteChunk
+ *
+ * Anything that goes wrong with a checked chunk (bad CRC, failed flash write)
+ * asks the host to send that chunk again rather than ending the session.
+ *
+ * @param byte The byte
+ */
+static void HandleCheckedChunkByte(uint8_t byte)
+{
+	int16_t pos = writePosInChunk++;
+	lastChunkByteTime = BootTimer_Micros();
+
+	if (pos < 2)
+	{
+		// A 0x10 that wasn't really the start of a chunk is caught here
+		if (byte != ((pos == 0) ? BOOTLOADER_CHUNK_SYNC_1 : BOOTLOADER_CHUNK_SYNC_2))
+		{
+			writePosInChunk = -1;
+			if (sessionUsesCheckedChunks)
+			{
+				StartChunkDrain(curWriteIndex);
+			}
+			else
+			{
+				// An older host doesn't send checked chunks, so the 0x10
+				// was a stray byte. Don't lose the command after it.
+				HandleEraseWriteByte(byte);
+			}
+		}
+		else if (pos == 1)
+		{
+			sessionUsesCheckedChunks = true;
+		}
+		return;
+	}
+
+	if (pos < 4)
+	{
+		checkedChunkIndex |= (uint16_t)byte << (8 * (pos - 2));
+	}
+	else if (pos < 4 + PROGRAM_CHUNK_SIZE_BYTES)
+	{
+		chunkBuffer[pos - 4] = byte;
+	}
+	else
+	{
+		checkedChunkExpectedCRC |= (uint32_t)byte << (8 * (pos - 4 - PROGRAM_CHUNK_SIZE_BYTES));
+	}
+
+	if (writePosInChunk < CHECKED_CHUNK_SIZE_BYTES)
+	{
+		return;
+	}
+
+	writePosInChunk = -1;
+
+	// The CRC covers the index too, so a damaged index can't send good data
+	// to the wrong place
+	uint8_t const indexBytes[2] = {(uint8_t)checkedChunkIndex, (uint8_t)(checkedChunkIndex >> 8)};
+	uint32_t crc = CRC32_Update(CRC32_INITIAL, indexBytes, sizeof(indexBytes));
+	crc = CRC32_Update(crc, chunkBuffer, PROGRAM_CHUNK_SIZE_BYTES);
+
+	if (CRC32_Final(crc) != checkedChunkExpectedCRC)
+	{
+		// We got exactly the right number of bytes, so we're still in sync
+		// with the host and can ask for a chunk again right away. The index
+		// can't be trusted, so ask for the one we're expecting next.
+		RequestChunkRetry(curWriteIndex);
+	}
+	else if (checkedChunkIndex >= FirmwareChunkCount())
+	{
+		// Retrying won't help here, but the session can continue
+		USBCDC_SendByte(BootloaderWriteError);
+	}
+	else
+	{
+		// Toggle the LED for some status
+		LED_Toggle();
+
+		if (WriteFlash(chunkBuffer, (uint32_t)checkedChunkIndex * (uint32_t)PROGRAM_CHUNK_SIZE_BYTES))
+		{
+			// Tell the host which chunk this was, in case it isn't the one
+			// it thinks it is
+			USBCDC_SendByte(BootloaderWriteOK);
+			USBCDC_SendByte((uint8_t)checkedChunkIndex);
+			USBCDC_SendByte((uint8_t)(checkedChunkIndex >> 8));
+			if (checkedChunkIndex >= curWriteIndex)
+			{
+				curWriteIndex = checkedChunkIndex + 1;
+			}
+			writeSessionBytes += PROGRAM_CHUNK_SIZE_BYTES;
+			writeSessionEndTime = BootTimer_Micros();
+		}
+		else
+		{
+			RequestChunkRetry(checkedChunkIndex);
+		}
+	}
+}
+
+/** Gives up on a checked chunk if the host stopped sending it partway through,
+ *  and asks for a retry once we've finished draining after losing sync
+ *
+ */
+static void CheckChunkTimeout(void)
+{
+	uint32_t idleTime = BootTimer_Micros() - lastChunkByteTime;
+
+	if (drainingChunk)
+	{
+		if (idleTime > CHECKED_CHUNK_DRAIN_US)
+		{
+			drainingChunk = false;
+			RequestChunkRetry(drainRetryIndex);
+		}
+	}
+	else if (checkedChunk && writePosInChunk >= 0 && idleTime > CHECKED_CHUNK_TIMEOUT_US)
+	{
+		// The index hasn't been checked by the CRC yet, so ask for the next
+		// one we expect. The rest of the chunk might still be on its way,
+		// so drain first.
+		writePosInChunk = -1;
+		StartChunkDrain(curWriteIndex);
+	}
+}
+
+/** Starts throwing away input until the host has stopped sending
+ *
+ * Asking for a retry while the rest of a bad chunk is still arriving would
+ * make us read its data as commands, so we wait for the line to go quiet.
+ *
+ * @param retryIndex The chunk to ask the host for once it's quiet
+ */
+static void StartChunkDrain(uint16_t retryIndex)
+{
+	drainingChunk = true;
+	drainRetryIndex = retryIndex;
+	lastChunkByteTime = BootTimer_Micros();
+}
+
+/** Asks the host to send a chunk (again)
+ *
+ * @param index The index of the chunk
+ */
+static void RequestChunkRetry(uint16_t index)
+{
+	USBCDC_SendByte(BootloaderWriteRetry);
+	USBCDC_SendByte((uint8_t)index);
+	USBCDC_SendByte((uint8_t)(index >> 8));
+}
+#endif
+
+#ifdef BOOTLOADER_NV_DATA
+/** Handler called when we receive a byte of an NV data read/write request
+ *
+ * @param byte The byte
+ */
+static void HandleNVRequestByte(uint8_t byte)
+{
+	// 32-bit offset followed by 16-bit length, both little-endian
+	if (nvPos < 4)
+	{
+		nvOffset |= (uint32_t)byte << (8 * nvPos);
+	}
+	else
+	{
+		nvLength |= (uint16_t)byte << (8 * (nvPos - 4));
+	}
+
+	if (++nvPos < 6)
+	{
+		return;
+	}
+
+	nvPos = 0;
+	uint32_t size = NVData_Size();
+	if (nvLength == 0 || nvLength > NONVOLATILE_DATA_MAX_BLOCK ||
+		nvOffset > size || nvLength > size - nvOffset)
+	{
+		USBCDC_SendByte(CommandReplyError);
+		curCommandState = WaitingForCommand;
+	}
+	else if (nvCommand == ReadNonvolatileData)
+	{
+		NVData_Read(chunkBuffer, nvOffset, nvLength);
+		USBCDC_SendByte(CommandReplyOK);
+		for (uint16_t i = 0; i < nvLength; i++)
+		{
+			USBCDC_SendByte(chunkBuffer[i]);
+		}
+		curCommandState = WaitingForCommand;
+	}
+	else
+	{
+		USBCDC_SendByte(CommandReplyOK);
+		curCommandState = WritingNVData;
+	}
+}
+
+/** Handler called when we receive a byte of NV data to write
+ *
+ * @param byte The byte
+ */
+static void HandleNVWriteByte(uint8_t byte)
+{
+	chunkBuffer[nvPos++] = byte;
+	if (nvPos >= nvLength)
+	{
+		// Toggle the LED for some status
+		LED_Toggle();
+
+		if (NVData_Write(chunkBuffer, nvOffset, nvLength, chunkBuffer + NONVOLATILE_DATA_MAX_BLOCK))
+		{
+			USBCDC_SendByte(CommandReplyOK);
+		}
+		else
+		{
+			USBCDC_SendByte(CommandReplyError);
+		}
+		curCommandState = WaitingForCommand;
+	}
+}
+#endif
+
+/** Records the time that a boot phase was reached, if not already recorded
+ *
+ * @param phase The boot phase
+ */
+static void RecordBootPhase(BootPhase phase)
+{
+	if (bootPhaseTimes[phase] == 0)
+	{
+		bootPhaseTimes[phase] = BootTimer_Micros();
+	}
+}
+
+/** Sends a 32-bit value out the USB serial port, least significant byte first
+ *
+ * @param value The value
+ */
+static void SendUInt32(uint32_t value)
+{
+	for (uint8_t i = 0; i < 4; i++)
+	{
+		USBCDC_SendByte((uint8_t)value);
+		value >>= 8;
+	}
+}
@@ -0,0 +1,59 @@
+/*
+ * usb_handoff.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: Doug
+ *
+ * Copyright (C) 2011-2026 Doug Brown
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USB_HANDOFF_H_
+#define USB_HANDOFF_H_
+
+#include <stdint.h>
+
+/// When the host asks for EnterProgrammerKeepUSB, the bootloader leaves the
+/// USB device attached and configured and jumps to the main firmware. The
+/// main firmware can then pick up where the bootloader left off instead of
+/// re-enumerating, so the host's serial port stays open.
+///
+/// The only thing handed off in software is the configuration number. The
+/// USB controller isn't reset by the jump, so the device address, endpoint
+/// setup and endpoint data toggles are still in its registers, and the main
+/// firmware must leave them alone (or read them before reconfiguring):
+///
+/// - AT90USB646/1286: GPIOR2 holds USB_HANDOFF_MAGIC_AVR and GPIOR1 holds the
+///   configuration number. LUFA keeps USB_DeviceState in GPIOR0, so that
+///   carries over as well. The address is in UDADDR. The data toggles can't
+///   be read on this chip, but they're untouched in the controller.
+/// - M258KE: the 32-bit word at 0x20003FFC (the same word the main firmware
+///   uses to ask us to stay in the bootloader, which is above the stack in
+///   both images) holds USB_HANDOFF_WORD(configuration). The address is in
+///   USBD->FADDR and each endpoint's next data toggle is DSQSYNC in
+///   USBD->EP[n].CFG.
+///
+/// These locations were chosen because nothing in either image's startup
+/// code touches them before main() runs.
+
+/// Magic value in the upper 16 bits of the M258's handoff word
+#define USB_HANDOFF_MAGIC			0xCDC0U
+/// Builds the M258's handoff word for a configuration number
+#define USB_HANDOFF_WORD(config)	(((uint32_t)USB_HANDOFF_MAGIC << 16) | (uint8_t)(config))
+/// Magic value in GPIOR2 on the AVR
+#define USB_HANDOFF_MAGIC_AVR		0xCD
+
+#endif /* USB_HANDOFF_H_ */